@@ -6,12 +6,20 @@
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/Twist.h>
 #include <geometry_msgs/Point.h>
+#include <geometry_msgs/PointStamped.h>
+#include <geometry_msgs/Pose2D.h>
+#include <geometry_msgs/Vector3.h>
 #include <nav_msgs/Odometry.h>
 #include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
 #include <math.h>
 //#include <rviz/grid_display.h>
 #include <tf2/LinearMath/Quaternion.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2/utils.h>
+#include <campos_potenciales/EvaluaCampos.h>
 // %EndTag(INCLUDES)%
 
 
@@ -68,9 +76,9 @@ private:
 public:
   Loc2D() : _x(0), _y(0), _angulo(0) {}
   Loc2D(double x, double y, double angulo) : _x(x), _y(y), _angulo(angulo){}
-  double x() { return _x; }
-  double y() { return _y; }
-  double angulo() { return _angulo; }
+  double x() const { return _x; }
+  double y() const { return _y; }
+  double angulo() const { return _angulo; }
   void x(double x) { this->_x = x; }
   void y(double y) { this->_y = y; }
   void angulo(double angulo) { this->_angulo = angulo; }
@@ -106,10 +114,14 @@ public:
     _posicion = cRobot;
   }
 
-  /** Obtiene las coordenadas del sensor dado el centro del robot. */
+  /** Obtiene las coordenadas del sensor dado el centro y la orientación del robot. */
   Loc2D getPosicion(const Loc2D pRobot)
   {
-    return pRobot + _posicion;
+    double c = cos(pRobot.angulo()), s = sin(pRobot.angulo());
+    Loc2D rotada(c * _posicion.x() - s * _posicion.y(),
+                 s * _posicion.x() + c * _posicion.y(),
+                 _posicion.angulo());
+    return pRobot + rotada;
   }
 
   /** Obtiene las coordenadas del sensor con respecto al centro del robot. */
@@ -122,12 +134,14 @@ public:
 
 class RobotInfo
 {
+public:
+  static const int NUM_SONARES = 6;
+
 private:
   VelocidadKobuki _velocidad;
   Loc2D _posicion;
 
   float RADIO = 0.175;  // 17.5cm
-  static const int NUM_SONARES = 6;
   Sonar sonares[NUM_SONARES];
 
   ros::Publisher marcas_sonar_pub;
@@ -147,10 +161,7 @@ public:
   {
     _posicion.x(odom.pose.pose.position.x);
     _posicion.y(odom.pose.pose.position.y);
-
-    // TODO
-    //tf2::Quaternion q;
-    //_posicion.ang(odom.pose.pose.orientation);
+    _posicion.angulo(tf2::getYaw(odom.pose.pose.orientation));
 /*
     for (int i = 0; i < NUM_SONARES; i++)
     {
@@ -164,12 +175,22 @@ public:
 
   /**
    * Actualiza los valores de las distancias a obstáculos medidas por los sonares.
+   * @param distancias una por sonar [m]; negativa si no hubo lectura.
    */
-  void tomaLecturaSonares()
+  void tomaLecturaSonares(const double distancias[])
   {
-
+    for (int i = 0; i < NUM_SONARES; i++)
+    {
+      Loc2D pos = sonares[i].getPosicion();
+      double d = distancias[i] > 0 ? distancias[i] : 0.0;
+      sonar_line_list.points[2*i + 1].x = pos.x() + d * cos(pos.angulo());
+      sonar_line_list.points[2*i + 1].y = pos.y() + d * sin(pos.angulo());
+    }
   }
 
+  /** Posición del sonar i según el odómetro. */
+  Loc2D posicionSonar(int i) { return sonares[i].getPosicion(_posicion); }
+
   VelocidadKobuki& velocidad() { return _velocidad; }
 
   Loc2D& posicion() { return _posicion; }
@@ -232,12 +253,370 @@ typedef struct structCoordsCelda {
   int j;
 } CoordsCelda;
 
+
+/**
+ * Recorre las celdas que atraviesa un rayo, en orden, al estilo de
+ * Amanatides y Woo.  Trabaja con el vector de dirección en lugar de la
+ * pendiente, por lo que no tiene casos especiales en ángulos verticales ni
+ * cuando el rayo pasa exactamente por una esquina de la rejilla.
+ * No reserva memoria: cada llamada a avanza() cuesta un par de comparaciones.
+ *
+ * Uso:
+ *   RecorridoCeldas r(x, y, cos(angulo), sin(angulo), RESOLUTION, WIDTH, HEIGHT);
+ *   for (; r.dentro(); r.avanza()) { ... r.i(), r.j(), r.distancia() ... }
+ */
+class RecorridoCeldas
+{
+private:
+  int _i, _j;             // Celda actual (renglón sobre y, columna sobre x).
+  int _pasoI, _pasoJ;     // -1, 0 ó 1 según el signo de la dirección.
+  double _tMaxX, _tMaxY;  // Distancia a la que se cruza la siguiente frontera.
+  double _tDeltaX, _tDeltaY;  // Distancia entre fronteras consecutivas.
+  double _t;              // Distancia a la que el rayo entró a la celda actual.
+  int _ancho, _alto;
+
+public:
+  /**
+   * @param x coordenada x del origen del rayo, relativa al origen del mapa [m].
+   * @param y coordenada y del origen del rayo, relativa al origen del mapa [m].
+   * @param dx componente x de la dirección, (dx, dy) debe ser unitario.
+   * @param dy componente y de la dirección.
+   * @param resolucion tamaño de la celda [m/cell].
+   * @param ancho número de columnas del mapa.
+   * @param alto número de renglones del mapa.
+   */
+  RecorridoCeldas(double x, double y, double dx, double dy,
+                  double resolucion, int ancho, int alto)
+    : _t(0), _ancho(ancho), _alto(alto)
+  {
+    _i = (int)floor(y / resolucion);
+    _j = (int)floor(x / resolucion);
+
+    _pasoJ = (dx > 0) - (dx < 0);
+    _pasoI = (dy > 0) - (dy < 0);
+
+    if (_pasoJ != 0)
+    {
+      double frontera = (_pasoJ > 0 ? _j + 1 : _j) * resolucion;
+      _tMaxX = (frontera - x) / dx;
+      _tDeltaX = resolucion / fabs(dx);
+    }
+    else
+    {
+      _tMaxX = _tDeltaX = INFINITY;
+    }
+
+    if (_pasoI != 0)
+    {
+      double frontera = (_pasoI > 0 ? _i + 1 : _i) * resolucion;
+      _tMaxY = (frontera - y) / dy;
+      _tDeltaY = resolucion / fabs(dy);
+    }
+    else
+    {
+      _tMaxY = _tDeltaY = INFINITY;
+    }
+  }
+
+  int i() const { return _i; }
+  int j() const { return _j; }
+
+  /** Distancia desde el origen del rayo hasta la entrada a la celda actual. */
+  double distancia() const { return _t; }
+
+  /** Indica si la celda actual está dentro del mapa. */
+  bool dentro() const
+  {
+    return _i >= 0 && _i < _alto && _j >= 0 && _j < _ancho;
+  }
+
+  /**
+   * Pasa a la siguiente celda.  Si el rayo cruza exactamente por una esquina
+   * avanza en diagonal, pues sólo toca a las otras dos celdas en un punto.
+   */
+  void avanza()
+  {
+    if (_tMaxX < _tMaxY)
+    {
+      _j += _pasoJ;
+      _t = _tMaxX;
+      _tMaxX += _tDeltaX;
+    }
+    else if (_tMaxY < _tMaxX)
+    {
+      _i += _pasoI;
+      _t = _tMaxY;
+      _tMaxY += _tDeltaY;
+    }
+    else
+    {
+      _j += _pasoJ;
+      _i += _pasoI;
+      _t = _tMaxX;
+      _tMaxX += _tDeltaX;
+      _tMaxY += _tDeltaY;
+    }
+  }
+};
+
+
+/**
+ * Cola de prioridad por cubetas para prioridades enteras en [0, maxima].
+ * Los nodos de las listas viven en un arreglo que se reutiliza (lista de
+ * nodos libres), así que tras calentarse no vuelve a reservar memoria.
+ */
+class ColaCubetas
+{
+private:
+  struct Nodo
+  {
+    int celda;
+    int siguiente;
+  };
+
+  std::vector<int> _cubetas;  // Primer nodo de cada cubeta, -1 si está vacía.
+  std::vector<Nodo> _nodos;   // Reserva de nodos.
+  int _libre;                 // Primer nodo libre, -1 si no hay.
+  int _minima;                // Ninguna cubeta menor a ésta tiene elementos.
+  int _tam;
+
+public:
+  ColaCubetas() : _libre(-1), _minima(0), _tam(0) {}
+
+  /** Prepara la cola para prioridades de 0 a maxima. */
+  void dimensiona(int maxima)
+  {
+    _cubetas.assign(maxima + 1, -1);
+    _nodos.clear();
+    _libre = -1;
+    _minima = maxima + 1;
+    _tam = 0;
+  }
+
+  bool vacia() const { return _tam == 0; }
+
+  void mete(int celda, int prioridad)
+  {
+    int n;
+    if (_libre != -1)
+    {
+      n = _libre;
+      _libre = _nodos[n].siguiente;
+    }
+    else
+    {
+      n = _nodos.size();
+      _nodos.push_back(Nodo());
+    }
+    _nodos[n].celda = celda;
+    _nodos[n].siguiente = _cubetas[prioridad];
+    _cubetas[prioridad] = n;
+    if (prioridad < _minima) _minima = prioridad;
+    _tam++;
+  }
+
+  /** Saca una celda con la menor prioridad.  La cola no debe estar vacía. */
+  int saca()
+  {
+    while (_cubetas[_minima] == -1) _minima++;
+    int n = _cubetas[_minima];
+    _cubetas[_minima] = _nodos[n].siguiente;
+    _nodos[n].siguiente = _libre;
+    _libre = n;
+    _tam--;
+    return _nodos[n].celda;
+  }
+};
+
+
+/**
+ * Mapa de distancias al obstáculo más cercano que se actualiza de forma
+ * incremental (brushfire dinámico, Lau et al. 2013).  Los cambios se
+ * acumulan con ocupa() y libera() y se propagan juntos con actualiza();
+ * sólo se visitan las celdas cuya distancia cambia y sus vecinas.
+ *
+ * Las distancias se guardan al cuadrado y en celdas para trabajar con
+ * enteros, que es lo que permite usar una cola por cubetas.  Sólo se
+ * propagan hasta un alcance máximo, de modo que el número de cubetas
+ * depende de ese alcance y no del tamaño del mapa.
+ */
+class MapaDistancias
+{
+private:
+  static const int SIN_OBSTACULO = -1;
+
+  struct Celda
+  {
+    int obstaculo;  // Índice del obstáculo más cercano, o SIN_OBSTACULO.
+    int dist2;      // Distancia al cuadrado a ese obstáculo [cells²].
+    bool elevar;    // La celda perdió su obstáculo y debe propagarlo.
+  };
+
+  int _ancho, _alto;
+  int _maxima2;     // Distancia al cuadrado más grande que se propaga.
+  int _infinito;    // Mayor que _maxima2: la celda no tiene obstáculo al alcance.
+  std::vector<Celda> _celdas;
+  std::vector<int> _cambios;
+  ColaCubetas _abiertas;
+
+public:
+  MapaDistancias() : _ancho(0), _alto(0), _maxima2(0), _infinito(1) {}
+
+  /**
+   * Reinicia el mapa sin obstáculos.
+   * @param alcance distancia máxima que se propaga [cells]; más lejos las
+   *        celdas quedan sin obstáculo.
+   */
+  void dimensiona(int ancho, int alto, int alcance)
+  {
+    _ancho = ancho;
+    _alto = alto;
+    _maxima2 = alcance * alcance;
+    _infinito = _maxima2 + 1;
+    Celda vacia = { SIN_OBSTACULO, _infinito, false };
+    _celdas.assign(ancho * alto, vacia);
+    _cambios.clear();
+    _abiertas.dimensiona(_maxima2);
+  }
+
+  /** Registra que la celda k está ocupada. */
+  void ocupa(int k)
+  {
+    Celda& c = _celdas[k];
+    if (c.obstaculo == k) return;
+    c.obstaculo = k;
+    c.dist2 = 0;
+    c.elevar = false;
+    _abiertas.mete(k, 0);
+    _cambios.push_back(k);
+  }
+
+  /** Registra que la celda k quedó libre. */
+  void libera(int k)
+  {
+    Celda& c = _celdas[k];
+    if (c.obstaculo != k) return;
+    c.obstaculo = SIN_OBSTACULO;
+    c.dist2 = _infinito;
+    c.elevar = true;
+    _abiertas.mete(k, 0);
+    _cambios.push_back(k);
+  }
+
+  /** Propaga los cambios registrados desde la última actualización. */
+  void actualiza()
+  {
+    while (!_abiertas.vacia())
+    {
+      int k = _abiertas.saca();
+      Celda& c = _celdas[k];
+      if (c.elevar)
+      {
+        eleva(k);
+      }
+      else if (c.obstaculo != SIN_OBSTACULO && esObstaculo(c.obstaculo))
+      {
+        baja(k);
+      }
+    }
+  }
+
+  /** Distancia al obstáculo más cercano [cells], INFINITY si no hay al alcance. */
+  double distancia(int k) const
+  {
+    if (_celdas[k].obstaculo == SIN_OBSTACULO) return INFINITY;
+    return sqrt((double)_celdas[k].dist2);
+  }
+
+  /** Índice del obstáculo más cercano a la celda k, -1 si no hay al alcance. */
+  int obstaculo(int k) const { return _celdas[k].obstaculo; }
+
+  /**
+   * Celdas cuya distancia cambió desde la última llamada a olvidaCambios().
+   * Puede haber repetidas.
+   */
+  const std::vector<int>& cambios() const { return _cambios; }
+
+  void olvidaCambios() { _cambios.clear(); }
+
+private:
+  bool esObstaculo(int k) const { return _celdas[k].obstaculo == k; }
+
+  /** Invalida las celdas que dependían de un obstáculo que desapareció. */
+  void eleva(int k)
+  {
+    int i = k / _ancho, j = k % _ancho;
+    for (int di = -1; di <= 1; di++)
+    {
+      for (int dj = -1; dj <= 1; dj++)
+      {
+        int ni = i + di, nj = j + dj;
+        if ((di == 0 && dj == 0) || ni < 0 || ni >= _alto || nj < 0 || nj >= _ancho) continue;
+        int n = ni * _ancho + nj;
+        Celda& v = _celdas[n];
+        if (v.obstaculo == SIN_OBSTACULO || v.elevar) continue;
+        // Se mete con su distancia anterior: si su obstáculo sigue ahí, la
+        // celda vuelve a propagarlo y llena el hueco que quedó.
+        _abiertas.mete(n, v.dist2);
+        if (!esObstaculo(v.obstaculo))
+        {
+          v.obstaculo = SIN_OBSTACULO;
+          v.dist2 = _infinito;
+          v.elevar = true;
+          _cambios.push_back(n);
+        }
+      }
+    }
+    _celdas[k].elevar = false;
+  }
+
+  /** Ofrece el obstáculo de la celda k a sus vecinas. */
+  void baja(int k)
+  {
+    int i = k / _ancho, j = k % _ancho;
+    int o = _celdas[k].obstaculo;
+    int oi = o / _ancho, oj = o % _ancho;
+    for (int di = -1; di <= 1; di++)
+    {
+      for (int dj = -1; dj <= 1; dj++)
+      {
+        int ni = i + di, nj = j + dj;
+        if ((di == 0 && dj == 0) || ni < 0 || ni >= _alto || nj < 0 || nj >= _ancho) continue;
+        int n = ni * _ancho + nj;
+        Celda& v = _celdas[n];
+        if (v.elevar) continue;
+        int d2 = (ni - oi) * (ni - oi) + (nj - oj) * (nj - oj);
+        if (d2 > _maxima2) continue;
+        if (d2 < v.dist2 ||
+            (d2 == v.dist2 && (v.obstaculo == SIN_OBSTACULO || !esObstaculo(v.obstaculo))))
+        {
+          v.obstaculo = o;
+          v.dist2 = d2;
+          _abiertas.mete(n, d2);
+          _cambios.push_back(n);
+        }
+      }
+    }
+  }
+};
+
 class Mapa {
 private:
   const int WIDTH = 24;          /// A lo largo del eje rojo x
   const int HEIGHT = 31;         /// A lo largo del eje verde
   const float RESOLUTION = 0.3f; /// [m/cell]
   const int OCUPADA = 100;       /// 100% de probabilidad
+  const int MARCA_RAYO = 50;     /// Celdas atravesadas por rayos en mapa_marcas
+  const double ALCANCE_DISTANCIAS = 2.0;   /// [m] Más lejos no se calculan distancias
+
+  /// Campo repulsivo
+  const double RADIO_ROBOT = 0.175;        /// [m]
+  const double ALCANCE_REPULSION = 1.0;    /// [m] Más lejos los obstáculos no empujan
+  const double GANANCIA_REPULSION = 0.05;
+  const double DISTANCIA_MINIMA = 0.01;    /// [m] Evita la división entre cero
+  const double FUERZA_MAXIMA = 10.0;       /// Dentro de un obstáculo o fuera del mapa
+  const double TIEMPO_OLVIDO = 1.0;        /// [s] Sin consultar, el robot deja de ser obstáculo
+  static const int BLOQUE = 8;             /// Robots evaluados juntos
 
   ros::Publisher marker_pub;     /// Publica todos los *marker*
 
@@ -251,8 +630,22 @@ private:
   /// Mapa y marcadores de operaciones en el mapa.
   ros::Publisher grid_pub;
   ros::Publisher grid_pub_marcas;
+  ros::Publisher grid_pub_distancias;
   nav_msgs::OccupancyGrid mapa;         // Mapa
   nav_msgs::OccupancyGrid mapa_marcas;  // Para depurado y visualización
+  nav_msgs::OccupancyGrid mapa_distancias;  // Cercanía a obstáculos, para visualización
+  MapaDistancias _distancias;           // Distancia de cada celda al obstáculo más cercano
+
+  /// Última posición conocida de cada robot que consulta el servicio.
+  struct RobotConocido
+  {
+    double x, y;
+    ros::Time visto;
+    int indice;   // Posición en _robotsX y _robotsY.
+  };
+  std::map<std::string, RobotConocido> _flotilla;
+  std::vector<double> _robotsX;
+  std::vector<double> _robotsY;
 
   ros::NodeHandle& r_n;
 
@@ -269,6 +662,7 @@ public:
     marker_pub = r_n.advertise<visualization_msgs::Marker>("visualization_marker", 5);
     grid_pub = r_n.advertise<nav_msgs::OccupancyGrid>("occupancy_marker", 1);
     grid_pub_marcas = r_n.advertise<nav_msgs::OccupancyGrid>("occupancy_marker_marcas", 1);
+    grid_pub_distancias = r_n.advertise<nav_msgs::OccupancyGrid>("occupancy_marker_distancias", 1);
     llenaVelocidad();
     llenaMeta();
     llenaMapa();
@@ -298,12 +692,17 @@ public:
     if (_colorPrevio != -1)
     {
       mapa_marcas.data[_celdaPrevia.i*WIDTH+_celdaPrevia.j] = _colorPrevio;
+      _colorPrevio = -1;
+    }
+    if (enMapa(coords))
+    {
+      _colorPrevio = mapa_marcas.data[coords.i*WIDTH+coords.j];
+      _celdaPrevia = coords;
+      mapa_marcas.data[coords.i*WIDTH+coords.j] = 20;
     }
-    _colorPrevio = mapa_marcas.data[coords.i*WIDTH+coords.j];
-    _celdaPrevia = coords;
-    mapa_marcas.data[coords.i*WIDTH+coords.j] = 20;
 
     //_robot_info.extraePosicion(odom);
+    simulaSonares();
 
     marca_meta.points[0].x = odom.pose.pose.position.x; //_robot_info.posicion().x();
     marca_meta.points[0].y = odom.pose.pose.position.y; //_robot_info.posicion().y();
@@ -347,10 +746,197 @@ public:
            );
   }
 
+  /**
+   * Recibe un punto publicado desde rviz (*Publish Point*) y alterna la
+   * celda correspondiente entre libre y ocupada.
+   */
+  void alternaCelda(const geometry_msgs::PointStamped& punto)
+  {
+    CoordsCelda coords = calculaCelda(punto.point.x, punto.point.y);
+    if (!enMapa(coords)) return;
+    if (mapa.data[mInd(coords.i, coords.j)] == OCUPADA)
+    {
+      liberaCelda(coords.i, coords.j);
+    }
+    else
+    {
+      ocupaCelda(coords.i, coords.j);
+    }
+  }
+
+  /**
+   * Evalúa el campo repulsivo para un lote de robots que comparten el mapa.
+   * Recuerda la última posición de cada robot durante TIEMPO_OLVIDO, y cada
+   * robot conocido es un obstáculo para los demás aunque consulten por
+   * separado.  Los robots del lote se procesan de BLOQUE en BLOQUE: el ciclo
+   * interno recorre los carriles del bloque, que son independientes, para
+   * que el compilador pueda vectorizarlo.
+   * @param robots identificador de cada robot.
+   * @param poses posición de cada robot, según el odómetro.
+   * @param ahora momento de la consulta.
+   * @param fuerzas fuerza repulsiva sobre cada robot, en el marco del odómetro.
+   * @param distancias distancia del centro de cada robot al obstáculo más
+   *        cercano [m]; -1 si el robot está fuera del mapa.
+   * @return falso si no hay un identificador por pose.
+   */
+  bool evaluaCampos(const std::vector<std::string>& robots,
+                    const std::vector<geometry_msgs::Pose2D>& poses,
+                    const ros::Time& ahora,
+                    std::vector<geometry_msgs::Vector3>& fuerzas,
+                    std::vector<float>& distancias)
+  {
+    if (robots.size() != poses.size()) return false;
+    const int n = poses.size();
+    fuerzas.resize(n);
+    distancias.resize(n);
+
+    // Actualiza la flotilla y olvida a los robots que ya no consultan.
+    for (int r = 0; r < n; r++)
+    {
+      RobotConocido& conocido = _flotilla[robots[r]];
+      conocido.x = poses[r].x;
+      conocido.y = poses[r].y;
+      conocido.visto = ahora;
+    }
+    const ros::Duration olvido(TIEMPO_OLVIDO);
+    for (std::map<std::string, RobotConocido>::iterator it = _flotilla.begin(); it != _flotilla.end(); )
+    {
+      if (ahora - it->second.visto > olvido) _flotilla.erase(it++);
+      else ++it;
+    }
+
+    // Posiciones contiguas de todos los robots conocidos.
+    const int total = _flotilla.size();
+    _robotsX.resize(total);
+    _robotsY.resize(total);
+    int indice = 0;
+    for (std::map<std::string, RobotConocido>::iterator it = _flotilla.begin(); it != _flotilla.end(); ++it)
+    {
+      it->second.indice = indice;
+      _robotsX[indice] = it->second.x;
+      _robotsY[indice] = it->second.y;
+      indice++;
+    }
+    const double* px = _robotsX.data();
+    const double* py = _robotsY.data();
+
+    for (int b = 0; b < n; b += BLOQUE)
+    {
+      const int m = (n - b < BLOQUE) ? n - b : BLOQUE;
+      double qx[BLOQUE], qy[BLOQUE], th[BLOQUE];  // Pose de cada carril.
+      double sx[BLOQUE], sy[BLOQUE];  // Punto desde el que empuja el obstáculo.
+      double d[BLOQUE];               // Distancia a la superficie del obstáculo.
+      bool fuera[BLOQUE];             // El robot está fuera del mapa.
+      double yo[BLOQUE];              // Índice del propio robot en px, py.
+      double c2[BLOQUE], cx[BLOQUE], cy[BLOQUE];  // Centro del robot más cercano.
+
+      // Obstáculos del mapa.  Los carriles sobrantes repiten al primer robot.
+      for (int r = 0; r < BLOQUE; r++)
+      {
+        const int p = b + (r < m ? r : 0);
+        qx[r] = poses[p].x;
+        qy[r] = poses[p].y;
+        th[r] = poses[p].theta;
+        yo[r] = _flotilla[robots[p]].indice;
+        obstaculoMasCercano(qx[r], qy[r], sx[r], sy[r], d[r]);
+        fuera[r] = d[r] < 0;
+        c2[r] = INFINITY;
+        cx[r] = cy[r] = 0;
+      }
+
+      // Los demás robots conocidos.  Basta comparar distancias al cuadrado
+      // entre centros, lo que deja al ciclo sin sqrt.  Leer los tres valores
+      // antes de escribirlos evita que el compilador use escrituras
+      // condicionales.  Si se desenrolla por completo el ciclo de los
+      // carriles, GCC ya no lo vectoriza con -O3.
+      for (int k = 0; k < total; k++)
+      {
+        const double xk = px[k], yk = py[k], ik = k;
+#pragma GCC unroll 1
+        for (int r = 0; r < BLOQUE; r++)
+        {
+          const double dx = qx[r] - xk, dy = qy[r] - yk;
+          const double dk2 = dx * dx + dy * dy;
+          const double c2r = c2[r], cxr = cx[r], cyr = cy[r];
+          const bool mejor = (ik != yo[r]) & (dk2 < c2r);
+          c2[r] = mejor ? dk2 : c2r;
+          cx[r] = mejor ? xk : cxr;
+          cy[r] = mejor ? yk : cyr;
+        }
+      }
+
+      // Se queda con el más cercano entre el mapa y los robots.
+      for (int r = 0; r < BLOQUE; r++)
+      {
+        const double dk = sqrt(c2[r]) - RADIO_ROBOT;
+        const bool robot = !fuera[r] & (dk < d[r]);
+        d[r] = robot ? dk : d[r];
+        sx[r] = robot ? cx[r] : sx[r];
+        sy[r] = robot ? cy[r] : sy[r];
+      }
+
+      // Fuerza repulsiva: crece como 1/d² dentro del alcance y es nula fuera.
+      // Fuera del mapa es la máxima.
+      for (int r = 0; r < BLOQUE; r++)
+      {
+        double dx = qx[r] - sx[r], dy = qy[r] - sy[r];
+        double norma = sqrt(dx * dx + dy * dy);
+        // Sin dirección (p. ej. dos robots en el mismo lugar): hacia atrás.
+        const bool sinDireccion = norma < 1e-6;
+        dx = sinDireccion ? -cos(th[r]) : dx;
+        dy = sinDireccion ? -sin(th[r]) : dy;
+        norma = sinDireccion ? 1.0 : norma;
+        const double dr = std::max(d[r], DISTANCIA_MINIMA);
+        double magnitud = GANANCIA_REPULSION * (1.0 / dr - 1.0 / ALCANCE_REPULSION) / (dr * dr);
+        magnitud = dr < ALCANCE_REPULSION ? std::min(magnitud, FUERZA_MAXIMA) : 0.0;
+        magnitud = fuera[r] ? FUERZA_MAXIMA : magnitud;
+        sx[r] = magnitud / norma * dx;
+        sy[r] = magnitud / norma * dy;
+      }
+
+      for (int r = 0; r < m; r++)
+      {
+        fuerzas[b + r].x = sx[r];
+        fuerzas[b + r].y = sy[r];
+        fuerzas[b + r].z = 0;
+        distancias[b + r] = fuera[r] ? -1.0f : (float)std::max(d[r], 0.0);
+      }
+    }
+    return true;
+  }
+
+  /** Atiende el servicio evalua_campos. */
+  bool atiendeEvaluaCampos(campos_potenciales::EvaluaCampos::Request& req,
+                           campos_potenciales::EvaluaCampos::Response& res)
+  {
+    _distancias.actualiza();
+    if (!evaluaCampos(req.robots, req.poses, ros::Time::now(), res.fuerzas, res.distancias))
+    {
+      ROS_WARN("evalua_campos: %zu robots y %zu poses", req.robots.size(), req.poses.size());
+      return false;
+    }
+    return true;
+  }
+
+  /** Publica los mapas cuando el nodo corre como servicio. */
+  void publicaPeriodico(const ros::TimerEvent&)
+  {
+    publiicate();
+  }
+
   void publiicate()
   {
+    // Los cambios al mapa desde la última publicación se propagan juntos.
+    _distancias.actualiza();
+    const std::vector<int>& cambios = _distancias.cambios();
+    for (size_t c = 0; c < cambios.size(); c++)
+    {
+      actualizaCercania(cambios[c]);
+    }
+    _distancias.olvidaCambios();
     grid_pub.publish(mapa);
     grid_pub_marcas.publish(mapa_marcas);
+    grid_pub_distancias.publish(mapa_distancias);
   }
 
 private:
@@ -414,11 +1000,16 @@ private:
   CoordsCelda calculaCelda(double dx, double dy)
   {
     CoordsCelda coords;
-    coords.i = (dy - mapa.info.origin.position.y) / RESOLUTION;
-    coords.j = (dx - mapa.info.origin.position.x) / RESOLUTION;
+    coords.i = (int)floor((dy - mapa.info.origin.position.y) / RESOLUTION);
+    coords.j = (int)floor((dx - mapa.info.origin.position.x) / RESOLUTION);
     return coords;
   }
 
+  bool enMapa(const CoordsCelda& coords)
+  {
+    return coords.i >= 0 && coords.i < HEIGHT && coords.j >= 0 && coords.j < WIDTH;
+  }
+
   /** Agrega los obstáculos al mapa */
   void llenaMapa()
   {
@@ -456,6 +1047,13 @@ private:
     mapa_marcas.info.origin.orientation.z = 0.0;
     mapa_marcas.info.origin.orientation.w = 1.0;
 
+    /// --- Cercanía a los obstáculos según el mapa de distancias
+
+    mapa_distancias.header.frame_id = "/odom";
+    mapa_distancias.header.stamp = ros::Time::now();   // No caduca
+    mapa_distancias.info = mapa_marcas.info;
+    mapa_distancias.info.origin.position.z = 0.02;
+
     /// ---
 
 
@@ -484,6 +1082,19 @@ private:
 
     mapa.data = std::vector<int8_t>(data, data + size);
 
+    _distancias.dimensiona(WIDTH, HEIGHT, (int)ceil(ALCANCE_DISTANCIAS / RESOLUTION));
+    for (int k = 0; k < size; k++)
+    {
+      if (mapa.data[k] == OCUPADA) _distancias.ocupa(k);
+    }
+    _distancias.actualiza();
+    _distancias.olvidaCambios();
+    mapa_distancias.data.resize(size);
+    for (int k = 0; k < size; k++)
+    {
+      actualizaCercania(k);
+    }
+
 
     // %EndTag(MAP_INIT)%
   }
@@ -496,6 +1107,74 @@ private:
   }
 
 
+  /**
+   * Busca el obstáculo del mapa más cercano a (x, y), en coordenadas del odómetro.
+   * @param ox, oy punto desde el que empuja el obstáculo.  Dentro de una celda
+   *        ocupada es el centro de la celda; fuera del mapa es el reflejo del
+   *        centro del mapa, para empujar hacia adentro.
+   * @param d distancia a ese punto [m]; 0 dentro de un obstáculo, -1 fuera del
+   *        mapa, INFINITY si no hay obstáculos a menos de ALCANCE_DISTANCIAS.
+   */
+  void obstaculoMasCercano(double x, double y, double& ox, double& oy, double& d)
+  {
+    double x0 = mapa.info.origin.position.x, y0 = mapa.info.origin.position.y;
+    CoordsCelda coords = calculaCelda(x, y);
+    if (!enMapa(coords))
+    {
+      ox = 2 * x - (x0 + WIDTH * RESOLUTION / 2.0);
+      oy = 2 * y - (y0 + HEIGHT * RESOLUTION / 2.0);
+      d = -1;
+      return;
+    }
+
+    int k = mInd(coords.i, coords.j);
+    int o = _distancias.obstaculo(k);
+    ox = x;
+    oy = y;
+    if (o == -1)
+    {
+      d = INFINITY;
+      return;
+    }
+    int oi = o / WIDTH, oj = o % WIDTH;
+    if (o == k)
+    {
+      ox = x0 + (oj + 0.5) * RESOLUTION;
+      oy = y0 + (oi + 0.5) * RESOLUTION;
+      d = 0;
+      return;
+    }
+    // Punto de la celda ocupada más cercano al robot.
+    ox = std::min(std::max(x, x0 + oj * RESOLUTION), x0 + (oj + 1) * RESOLUTION);
+    oy = std::min(std::max(y, y0 + oi * RESOLUTION), y0 + (oi + 1) * RESOLUTION);
+    d = sqrt((x - ox) * (x - ox) + (y - oy) * (y - oy));
+  }
+
+  /**
+   * Copia a mapa_distancias la distancia de la celda k: 100 sobre un
+   * obstáculo, 0 a ALCANCE_DISTANCIAS o más.
+   */
+  void actualizaCercania(int k)
+  {
+    double d = _distancias.distancia(k) * RESOLUTION;
+    mapa_distancias.data[k] = d < ALCANCE_DISTANCIAS ? (int8_t)lround(100 * (1 - d / ALCANCE_DISTANCIAS)) : 0;
+  }
+
+  /** Marca la celda como ocupada, registrando el cambio en el mapa de distancias. */
+  void ocupaCelda(int i, int j)
+  {
+    mapa.data[mInd(i, j)] = OCUPADA;
+    _distancias.ocupa(mInd(i, j));
+  }
+
+  /** Marca la celda como libre, registrando el cambio en el mapa de distancias. */
+  void liberaCelda(int i, int j)
+  {
+    mapa.data[mInd(i, j)] = 0;
+    _distancias.libera(mInd(i, j));
+  }
+
+
   /** Sets the cells between [i1,j1] and [i2,j2] inclusive as occupied with probability value. */
   void fillRectangle(char* data, int i1, int j1, int i2, int j2, int value)
   {
@@ -509,178 +1188,77 @@ private:
   }
 
 
-  /**
-     * Acciones a realizar cuando se ha detectado una colisión.
-     * @param x coordenada x del origen del rayo
-     * @param y coordenada y del origen del rayo
-     * @param xn
-     * @param yn
-     * @return
-     */
-  double colision(double x, double y, double xn, double yn)
+  /** Crea el recorrido de un rayo que sale de (x, y), en coordenadas del odómetro. */
+  RecorridoCeldas lanzaRayo(double x, double y, double angulo)
+  {
+    return RecorridoCeldas(x - mapa.info.origin.position.x,
+                           y - mapa.info.origin.position.y,
+                           cos(angulo), sin(angulo),
+                           RESOLUTION, WIDTH, HEIGHT);
+  }
+
+  /** Marca en mapa_marcas una celda atravesada por un rayo. */
+  void marcaRayo(int i, int j)
+  {
+    if (mapa_marcas.data[mInd(i, j)] == 0)
+    {
+      mapa_marcas.data[mInd(i, j)] = MARCA_RAYO;
+    }
+  }
+
+  /** Borra de mapa_marcas los trazos de los rayos. */
+  void borraRayos()
   {
-    //float[] colision = {(float)xn, (float)yn};
-    //colisiones.add(colision);
-    return sqrt(pow(xn - x, 2) + pow(yn - y, 2));
+    for (size_t k = 0; k < mapa_marcas.data.size(); k++)
+    {
+      if (mapa_marcas.data[k] == MARCA_RAYO) mapa_marcas.data[k] = 0;
+    }
+    // Que leePosicion no restaure un trazo ya borrado.
+    if (_colorPrevio == MARCA_RAYO) _colorPrevio = 0;
+  }
+
+  /** Mide con rayos la distancia que vería cada sonar y la muestra en rviz. */
+  void simulaSonares()
+  {
+    double distancias[RobotInfo::NUM_SONARES];
+    for (int i = 0; i < RobotInfo::NUM_SONARES; i++)
+    {
+      Loc2D pos = _robot_info.posicionSonar(i);
+      distancias[i] = distanciaAColision(pos.x(), pos.y(), pos.angulo(), i == 0);
+    }
+    _robot_info.tomaLecturaSonares(distancias);
   }
 
   /**
    * Lanza un rayo a partir de las coordenadas (<code>x</code>,<code>y</code>)
    * en dirección <code>angulo</code> y devuelve la distancia al obstáculo más
-   * cercano o a un muro en el mapa.
-   * @param x coordenada horizontal, de izquierda a derecha.
-   * @param y coordenada vertical, de arriba a abajo.
+   * cercano o al borde del mapa.  Las celdas libres que atraviesa quedan
+   * marcadas en mapa_marcas.
+   * @param x coordenada x, según el odómetro.
+   * @param y coordenada y, según el odómetro.
    * @param ángulo dirección en la que se extiende el rayo en radianes.
    * @param limpia borra las línea usadas para calcular las distancias.
-   * @return distancia
+   * @return distancia, 0 si el origen está dentro de un obstáculo o -1 si
+   *         está fuera del mapa.
    */
-  double distanciaAColision(double x, double y, double angulo, bool limpia) {
-        /*if (limpia) {
-            origen[0] = x;
-            origen[1] = y;
-            ilumina.clear();
-            colisiones.clear();
-        }*/
-        angulo = anguloEnRango(angulo);
-        double m = tan(angulo);
-        double b = - y - m * x;  // y está invertida
-        CoordsCelda ij = calculaCelda(x, y);
-        int i = ij.i, j = ij.j;
-        double xn, yn;
-
-        if (angulo > 0) {
-            if (angulo < M_PI/2) {
-                // Primer cuadrante
-                int l = i, k = j;
-                // arriba y a la derecha
-                while(k < WIDTH && l >= 0) {
-                    //int indx[2] = {l, k};
-                    //ilumina.add(indx);
-
-                    xn = (k + 1) * RESOLUTION;
-                    yn = y - m * (xn - x);
-                    if (yn < (l + 1) * RESOLUTION && yn > l * RESOLUTION) {
-                        k++; // ve a la derecha
-                        if (k == WIDTH || mapa.data[mInd(l, k)] == OCUPADA) {
-                            //System.out.println("Caso 1");
-                            return colision(x, y, xn, yn);
-                        }
-                    } else if (yn == l * RESOLUTION) {
-                        k++; // a la derecha
-                        l--; // arriba
-                        if (l < 0 || k == WIDTH || mapa.data[mInd(l, k)] == OCUPADA) {
-                            //System.out.println("Caso 2");
-                            return colision(x, y, xn, yn);
-                        }
-                    } else {
-                        l--; // arriba
-
-                        yn = (l + 1) * RESOLUTION;
-                        xn = (-yn - b)/m;
-                        if (l < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            //System.out.println("Caso 3");
-                            return colision(x, y, xn, yn);
-                        }
-                    }
-                }
-            } else if (angulo <= M_PI) {
-                // Segundo cuadrante
-                int l = i, k = j;
-                // arriba y a la izquierda
-                while(k >= 0 && l >= 0) {
-                    //int[] indx = {l, k};
-                    //ilumina.add(indx);
-                    yn = l * RESOLUTION;
-                    xn = (-yn - b)/m;
-                    if (xn > k * RESOLUTION && xn < (k + 1) * RESOLUTION) {
-                        l--; // ve arriba
-                        if (l < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            return colision(x, y, xn, yn);
-                        }
-                    } else if (xn == (k + 1) * RESOLUTION) {
-                        k--; // a la izquierda
-                        l--; // arriba
-                        if (l < 0 || k < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            return colision(x, y, xn, yn);
-                        }
-                    } else {
-                        k--; // a la izquierda
-                        xn = (k + 1) * RESOLUTION;
-                            yn = y - m * (xn - x);
-                        if (k < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            return colision(x, y, xn, yn);
-                        }
-                    }
-                }
-            }
-        } else {
-            if (angulo > -M_PI/2) {
-                // Cuarto cuadrante
-                int l = i, k = j;
-                // abajo y a la derecha
-                while(k < WIDTH && l < HEIGHT) {
-                    //int[] indx = {l, k};
-                    //ilumina.add(indx);
-
-                    xn = (k + 1) * RESOLUTION;
-                    yn = y - m * (xn - x);
-                    if (yn < (l + 1) * RESOLUTION && yn > l * RESOLUTION) {
-                        k++; // ve a la derecha
-                        if (k == WIDTH || mapa.data[mInd(l, k)] == OCUPADA) {
-                            //System.out.println("Caso 1");
-                            return colision(x, y, xn, yn);
-                        }
-                    } else if (yn == (l + 1) * RESOLUTION) {
-                        k++; // a la derecha
-                        l++; // abajo
-                        if (l == HEIGHT || k == WIDTH && mapa.data[mInd(l, k)] == OCUPADA) {
-                            //System.out.println("Caso 2");
-                            return colision(x, y, xn, yn);
-                        }
-                    } else {
-                        l++; // abajo
-                        if (l == HEIGHT || mapa.data[mInd(l, k)] == OCUPADA) {
-                            yn = l * RESOLUTION;
-                            xn = (-yn - b)/m;
-                            //System.out.println("Caso 3");
-                            return colision(x, y, xn, yn);
-                        }
-                    }
-                }
-            } else if (angulo > -M_PI) {
-                // Tercer cuadrante
-                int l = i, k = j;
-                // abajo y a la izquierda
-                while(k >= 0 && l < HEIGHT) {
-                    //int[] indx = {l, k};
-                    //ilumina.add(indx);
-                    yn = (l + 1) * RESOLUTION;
-                    xn = (-yn - b)/m;
-                    if (xn > k * RESOLUTION && xn < (k + 1) * RESOLUTION) {
-                        l++; // ve abajo
-                        if (l == HEIGHT || mapa.data[mInd(l, k)] == OCUPADA) {
-                            return colision(x, y, xn, yn);
-                        }
-                    } else if (xn == (k + 1) * RESOLUTION) {
-                        k--; // a la izquierda
-                        l++; // ve abajo
-                        if (l == HEIGHT || k < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            return colision(x, y, xn, yn);
-                        }
-                    } else {
-                        k--; // a la izquierda
-                        if (k < 0 || mapa.data[mInd(l, k)] == OCUPADA) {
-                            xn = (k + 1) * RESOLUTION;
-                            yn = y - m * (xn - x);
-
-                            return colision(x, y, xn, yn);
-                        }
-                    }
-                }
-            }
-        }
-        return -1;
+  double distanciaAColision(double x, double y, double angulo, bool limpia)
+  {
+    if (limpia)
+    {
+      borraRayos();
     }
+    RecorridoCeldas r = lanzaRayo(x, y, angulo);
+    if (!r.dentro()) return -1;
+    for (; r.dentro(); r.avanza())
+    {
+      if (mapa.data[mInd(r.i(), r.j())] == OCUPADA)
+      {
+        return r.distancia();
+      }
+      marcaRayo(r.i(), r.j());
+    }
+    return r.distancia();
+  }
 
 
 };
@@ -693,8 +1271,23 @@ int main( int argc, char** argv )
 {
   ros::init(argc, argv, "basic_map");
   ros::NodeHandle n;
+  ros::NodeHandle n_privado("~");
+  bool servicio;
+  n_privado.param("servicio", servicio, false);
   ros::Rate r(1);
   Mapa mapa(n);
+  ros::Subscriber sub_punto = n.subscribe("/clicked_point", 10, &Mapa::alternaCelda, &mapa);
+
+  if (servicio)
+  {
+    // Un solo mapa para toda la flotilla: cada robot consulta sus fuerzas
+    // con el servicio en lugar de suscribirse a su odometría aquí.
+    ros::ServiceServer srv = n.advertiseService("evalua_campos", &Mapa::atiendeEvaluaCampos, &mapa);
+    ros::Timer timer = n.createTimer(r.expectedCycleTime(), &Mapa::publicaPeriodico, &mapa);
+    ros::spin();
+    return 0;
+  }
+
   ros::Subscriber sub = n.subscribe("/move_base_simple/goal", 2, &Mapa::receiveNavGoal, &mapa); // Máximo 2 mensajes en la cola.
   ros::Subscriber sub_vel = n.subscribe("/mobile_base/commands/velocity", 2, &Mapa::publicaVelocidad, &mapa); // Máximo 2 mensajes en la cola.
   ros::Subscriber sub_odom = n.subscribe("/odom", 2, &Mapa::leePosicion, &mapa);